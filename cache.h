@@ -0,0 +1,126 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+// One of the 8 symmetries of the square: transpose if bit 2 is set,
+// then flip the rows if bit 1 is set, then flip the columns if bit 0 is set.
+inline std::vector<std::string> transform_grid(
+    const std::vector<std::string>& grid, int symmetry) {
+  int height = grid.size();
+  int width = height > 0 ? grid[0].size() : 0;
+  bool transpose = symmetry & 4;
+  int out_height = transpose ? width : height;
+  int out_width = transpose ? height : width;
+  std::vector<std::string> out(out_height, std::string(out_width, ' '));
+  for (int j = 0; j < out_height; j++) {
+    for (int i = 0; i < out_width; i++) {
+      int y = symmetry & 2 ? out_height - 1 - j : j;
+      int x = symmetry & 1 ? out_width - 1 - i : i;
+      out[j][i] = transpose ? grid[x][y] : grid[y][x];
+    }
+  }
+  return out;
+}
+
+inline int inverse_symmetry(int symmetry) {
+  if (symmetry & 4) {
+    return 4 | (symmetry & 1) << 1 | (symmetry & 2) >> 1;
+  }
+  return symmetry;
+}
+
+// Solutions indexed by the puzzle grid, shared by all the rotations and
+// reflections of the same puzzle. A solution is a grid with twice the
+// resolution of the puzzle, so it transforms along with it. Entries are
+// appended to filename, if given, and loaded back on construction.
+class SolutionCache {
+  std::string kind;
+  const char* filename;
+  std::unordered_map<std::string, std::vector<std::string>> entries;
+  int lookups, hits;
+
+  static std::string serialize(const std::vector<std::string>& grid) {
+    std::string key = std::to_string(grid.size()) + " " +
+        std::to_string(grid.empty() ? 0 : grid[0].size());
+    for (const auto& row : grid) {
+      key += "\n" + row;
+    }
+    return key;
+  }
+
+  // Returns the key of the smallest orientation, and which one it is.
+  std::string canonical(const std::vector<std::string>& grid,
+      int* symmetry) const {
+    std::string best;
+    for (int i = 0; i < 8; i++) {
+      std::string key = kind + " " + serialize(transform_grid(grid, i));
+      if (i == 0 || key < best) {
+        best = key;
+        *symmetry = i;
+      }
+    }
+    return best;
+  }
+
+  static bool read_grid(std::istream& in, std::vector<std::string>* grid) {
+    int height, width;
+    if (!(in >> height >> width)) {
+      return false;
+    }
+    grid->resize(height);
+    for (auto& row : *grid) {
+      in >> row;
+    }
+    return bool(in);
+  }
+
+ public:
+  SolutionCache(const std::string& kind_, const char* filename_)
+      : kind(kind_), filename(filename_), lookups(0), hits(0) {
+    if (filename == nullptr) {
+      return;
+    }
+    std::ifstream in(filename);
+    std::string entry_kind;
+    std::vector<std::string> grid, solution;
+    while (in >> entry_kind && read_grid(in, &grid) &&
+           read_grid(in, &solution)) {
+      if (entry_kind == kind) {
+        int symmetry = 0;
+        std::string key = canonical(grid, &symmetry);
+        entries[key] = transform_grid(solution, symmetry);
+      }
+    }
+  }
+
+  bool lookup(const std::vector<std::string>& grid,
+      std::vector<std::string>* solution) {
+    lookups++;
+    int symmetry = 0;
+    auto entry = entries.find(canonical(grid, &symmetry));
+    if (entry == entries.end()) {
+      return false;
+    }
+    hits++;
+    *solution = transform_grid(entry->second, inverse_symmetry(symmetry));
+    return true;
+  }
+
+  void store(const std::vector<std::string>& grid,
+      const std::vector<std::string>& solution) {
+    int symmetry = 0;
+    std::string key = canonical(grid, &symmetry);
+    entries[key] = transform_grid(solution, symmetry);
+    if (filename != nullptr) {
+      std::ofstream out(filename, std::ios::app);
+      out << kind << " " << serialize(grid) << "\n"
+          << serialize(solution) << "\n";
+    }
+  }
+
+  void report() {
+    std::cout << "Cache hits: " << hits << "/" << lookups << "\n";
+  }
+};
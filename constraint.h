@@ -1,4 +1,5 @@
 #include <iostream>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <cctype>
@@ -6,6 +7,20 @@
 #include <cstdio>
 #include <limits>
 #include <queue>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+// AVX2 code is compiled on its own and only runs when the processor
+// supports it, so the build stays portable.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONSTRAINT_AVX2
+#include <immintrin.h>
+#endif
+#include "trace.h"
+#include "transposition.h"
 
 struct VariableId {
   int id;
@@ -20,12 +35,26 @@ struct Variable {
   int lmin, lmax;
   VariableId id;
   std::vector<int> constraints;
+  // Number of constraints the variable appears in, counting each sum of
+  // a bulk constraint separately.
+  int degree;
 };
 
 struct Bounds {
   int lmin, lmax;
 };
 
+// Mixes the bits of x, so that nearby inputs give unrelated hashes.
+inline uint64_t mix_hash(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+inline uint64_t mix_bounds(uint64_t h, int lmin, int lmax) {
+  return mix_hash(h ^ uint64_t(uint32_t(lmin)) << 32 ^ uint32_t(lmax));
+}
+
 struct Metadata {
   VariableId id;
   std::vector<int> constraints;
@@ -34,15 +63,39 @@ struct Metadata {
 class State {
   std::vector<Bounds> bounds, solution;
   std::vector<Metadata> metadata;
+  // The hash is only kept when hashing, and is zero otherwise.
+  bool hashing;
+  StateHash hash;
+
+  // Zobrist key of a variable with the given bounds, and its check taken
+  // from another mix of the key.
+  static StateHash zobrist(VariableId id, int lmin, int lmax) {
+    uint64_t key =
+        mix_hash(uint64_t(int(id)) << 32 ^ uint64_t(lmin) << 16 ^ lmax);
+    return StateHash{key, uint32_t(mix_hash(key) >> 32)};
+  }
+
+  StateHash compute_hash() const {
+    StateHash h{0, 0};
+    if (!hashing) {
+      return h;
+    }
+    for (int i = 0; i < int(bounds.size()); i++) {
+      h ^= zobrist(i, bounds[i].lmin, bounds[i].lmax);
+    }
+    return h;
+  }
  public:
-  State(const std::vector<Variable>& variables) 
-      : bounds(variables.size()), metadata(variables.size()) {
+  State(const std::vector<Variable>& variables, bool hashing_) 
+      : bounds(variables.size()), metadata(variables.size()),
+        hashing(hashing_) {
     for (const Variable& var : variables) {
       bounds[var.id].lmin = var.lmin;
       bounds[var.id].lmax = var.lmax;
       metadata[var.id].id = var.id;
       metadata[var.id].constraints = var.constraints;
     }
+    hash = compute_hash();
   }
 
   void save_solution() {
@@ -66,22 +119,60 @@ class State {
   }
 
   void change_var(VariableId var_id, int lmin, int lmax) {
+    if (hashing) {
+      hash ^= zobrist(var_id, bounds[var_id].lmin, bounds[var_id].lmax);
+      hash ^= zobrist(var_id, lmin, lmax);
+    }
     bounds[var_id].lmin = lmin;
     bounds[var_id].lmax = lmax;
   }
 
-  const std::vector<Bounds>& get_variables() {
+  // Hash of all the bounds, kept up to date by change_var when hashing.
+  StateHash get_hash() const {
+    return hash;
+  }
+
+  const std::vector<Bounds>& get_variables() const {
     return bounds;
   }
 
+  int size() const {
+    return bounds.size();
+  }
+
   void set_variables(const std::vector<Bounds>& new_vars) {
     bounds = new_vars;
+    hash = compute_hash();
+  }
+
+  // Faster version when the hash of new_vars is already known.
+  void set_variables(const std::vector<Bounds>& new_vars,
+      const StateHash& new_hash) {
+    bounds = new_vars;
+    hash = new_hash;
   }
 };
 
 class ExternalConstraint {
  public:
   virtual bool operator()(const State* state) const = 0;
+
+  // Projects the constraint onto independent components of the free
+  // variables. Free variables in the same group are never split apart.
+  // Returns false if checking each component alone is not enough and the
+  // combined solution must be checked again. By default the constraint
+  // ties all free variables together, so the problem is never split.
+  virtual bool project(const State* state,
+      std::vector<std::vector<VariableId>>* groups) const {
+    std::vector<VariableId> group;
+    for (int i = 0; i < state->size(); i++) {
+      if (!state->fixed(i)) {
+        group.push_back(i);
+      }
+    }
+    groups->push_back(group);
+    return true;
+  }
 };
 
 class ConstraintQueue;
@@ -91,6 +182,40 @@ class TightenConstraint {
   virtual bool update_constraint(
       State *state, ConstraintQueue* cqueue) const = 0;
   virtual const std::vector<VariableId>& get_variables() const = 0;
+
+  // Number of relations in the constraint that use the variable.
+  virtual int degree(VariableId var) const {
+    return 1;
+  }
+
+  // When true, the queue keeps the variables changed since the constraint
+  // last ran, so that it only checks the relations that use them.
+  virtual bool tracks_changes() const {
+    return false;
+  }
+
+  // Number of relations that are told apart in the trace, when the
+  // constraint reports which one failed through the queue.
+  virtual int parts() const {
+    return 0;
+  }
+
+  // Adds the groups of variables that the constraint ties together, when
+  // they are finer than all of its variables. Returns false otherwise.
+  virtual bool split_variables(
+      std::vector<std::vector<VariableId>>* groups) const {
+    return false;
+  }
+
+  // Hash of the constraint, so that a checkpoint is never resumed on
+  // another model. By default only the variables are hashed.
+  virtual uint64_t fingerprint() const {
+    uint64_t h = 0;
+    for (VariableId id : get_variables()) {
+      h = mix_hash(h ^ uint32_t(int(id)));
+    }
+    return h;
+  }
 };
 
 class ConstraintQueue {
@@ -98,18 +223,34 @@ class ConstraintQueue {
   const std::vector<const TightenConstraint*>& constraints;
   std::queue<int> active_constraints;
   std::vector<bool> queued_constraints;
+  // Changed variables of each constraint that tracks changes. At first
+  // they hold all of its variables, so that everything is checked.
+  std::vector<bool> tracked;
+  std::vector<std::vector<VariableId>> changes;
+  int current;
+  int part;
  public:
   ConstraintQueue(const std::vector<Variable>& variables_,
       const std::vector<const TightenConstraint*>& constraints_)
-      : variables(variables_), constraints(constraints_) {
+      : variables(variables_), constraints(constraints_), current(-1),
+        part(-1) {
     queued_constraints.resize(constraints.size(), true);
+    tracked.resize(constraints.size());
+    changes.resize(constraints.size());
     for (int i = 0; i < int(constraints.size()); i++) {
       active_constraints.push(i);
+      tracked[i] = constraints[i]->tracks_changes();
+      if (tracked[i]) {
+        changes[i] = constraints[i]->get_variables();
+      }
     }
   }
 
   void push_variable(VariableId index) {
     for (int cons : variables[index].constraints) {
+      if (tracked[cons]) {
+        changes[cons].push_back(index);
+      }
       if (!queued_constraints[cons]) {
         active_constraints.push(cons);
         queued_constraints[cons] = true;
@@ -117,10 +258,40 @@ class ConstraintQueue {
     }
   }
 
+  // Like push_variable, but does not queue the constraint being updated
+  // again, for constraints that always run to their own fixpoint.
+  void push_variable_except_current(VariableId index) {
+    for (int cons : variables[index].constraints) {
+      if (tracked[cons]) {
+        changes[cons].push_back(index);
+      }
+      if (!queued_constraints[cons] && cons != current) {
+        active_constraints.push(cons);
+        queued_constraints[cons] = true;
+      }
+    }
+  }
+
+  // Variables changed since the constraint being updated last ran, when
+  // it tracks changes. It must empty the list once they are checked.
+  std::vector<VariableId>* changed_variables() {
+    return &changes[current];
+  }
+
+  // Part of the constraint being updated that failed, or -1.
+  void set_conflict_part(int part_) {
+    part = part_;
+  }
+
+  int conflict_part() const {
+    return part;
+  }
+
   int pop_constraint() {
     int cons = active_constraints.front();
     active_constraints.pop();
     queued_constraints[cons] = false;
+    current = cons;
     return cons;
   }
 
@@ -128,12 +299,18 @@ class ConstraintQueue {
     return active_constraints.empty();
   }
 
+  // Drops the queue after a conflict. The state goes back to one where
+  // every constraint held, so the changes are dropped too.
   void clear() {
     while (!active_constraints.empty()) {
       int id = active_constraints.front();
       active_constraints.pop();
       queued_constraints[id] = false;
     }
+    for (auto& vars : changes) {
+      vars.clear();
+    }
+    part = -1;
   }
 };
 
@@ -152,6 +329,10 @@ class LinearConstraint : public TightenConstraint {
     return variables;
   }
 
+  virtual uint64_t fingerprint() const {
+    return mix_bounds(TightenConstraint::fingerprint(), lmin, lmax);
+  }
+
   virtual bool update_constraint(State *state, ConstraintQueue* cqueue) const {
     int allmax = 0, allmin = 0;
     for (const VariableId& ivar : variables) {
@@ -187,20 +368,439 @@ class LinearConstraint : public TightenConstraint {
   }
 };
 
+// Many linear constraints of up to four variables each, like the cells and
+// vertices of a grid, propagated together in bulk. The sums are evaluated
+// over arrays of variable indices in blocks of eight, all at once when
+// the processor has AVX2, and only the blocks that use a changed variable
+// are swept again, until nothing changes.
+class BulkLinearConstraint : public TightenConstraint {
+  static const int kSlots = 4;
+  static const int kBlock = 8;
+  // Index of each variable times two, so it points into an array of
+  // Bounds, and -1 or 0 to tell used slots from padding.
+  std::vector<int> index[kSlots], valid[kSlots];
+  std::vector<int> lmin, lmax;
+  std::vector<VariableId> variables;
+  std::vector<int> count;
+  // Blocks of sums that use each variable.
+  std::vector<std::vector<int>> blocks;
+  bool avx2;
+
+  bool narrow(State* state, ConstraintQueue* cqueue, VariableId var,
+      int newmin, int newmax) const {
+    int lo = std::max(newmin, state->read_lmin(var));
+    int hi = std::min(newmax, state->read_lmax(var));
+    if (lo > hi) {
+      return false;
+    }
+    if (lo != state->read_lmin(var) || hi != state->read_lmax(var)) {
+      state->change_var(var, lo, hi);
+      cqueue->push_variable_except_current(var);
+    }
+    return true;
+  }
+
+  bool update_sum(State* state, ConstraintQueue* cqueue, int k) const {
+    int allmin = 0, allmax = 0;
+    for (int s = 0; s < kSlots && valid[s][k]; s++) {
+      allmin += state->read_lmin(index[s][k] / 2);
+      allmax += state->read_lmax(index[s][k] / 2);
+    }
+    if (allmax < lmin[k] || allmin > lmax[k]) {
+      cqueue->set_conflict_part(k);
+      return false;
+    }
+    for (int s = 0; s < kSlots && valid[s][k]; s++) {
+      VariableId var = index[s][k] / 2;
+      int vmin = state->read_lmin(var), vmax = state->read_lmax(var);
+      if (!narrow(state, cqueue, var, lmin[k] - allmax + vmax,
+                  lmax[k] - allmin + vmin)) {
+        cqueue->set_conflict_part(k);
+        return false;
+      }
+    }
+    return true;
+  }
+
+#ifdef CONSTRAINT_AVX2
+  __attribute__((target("avx2")))
+  bool update_block(State* state, ConstraintQueue* cqueue, int k) const {
+    const int* bounds =
+        reinterpret_cast<const int*>(state->get_variables().data());
+    __m256i vmin[kSlots], vmax[kSlots], mask[kSlots];
+    __m256i allmin = _mm256_setzero_si256(), allmax = allmin;
+    for (int s = 0; s < kSlots; s++) {
+      __m256i idx = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(&index[s][k]));
+      mask[s] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(&valid[s][k]));
+      vmin[s] = _mm256_and_si256(
+          _mm256_i32gather_epi32(bounds, idx, 4), mask[s]);
+      vmax[s] = _mm256_and_si256(
+          _mm256_i32gather_epi32(bounds + 1, idx, 4), mask[s]);
+      allmin = _mm256_add_epi32(allmin, vmin[s]);
+      allmax = _mm256_add_epi32(allmax, vmax[s]);
+    }
+    __m256i cmin = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(&lmin[k]));
+    __m256i cmax = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(&lmax[k]));
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi32(cmin, allmax),
+                                  _mm256_cmpgt_epi32(allmin, cmax));
+    if (!_mm256_testz_si256(bad, bad)) {
+      int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+      cqueue->set_conflict_part(k + __builtin_ctz(lanes));
+      return false;
+    }
+    __m256i newmin[kSlots], newmax[kSlots], diff[kSlots];
+    __m256i any = _mm256_setzero_si256();
+    for (int s = 0; s < kSlots; s++) {
+      newmin[s] = _mm256_max_epi32(vmin[s], _mm256_add_epi32(
+          _mm256_sub_epi32(cmin, allmax), vmax[s]));
+      newmax[s] = _mm256_min_epi32(vmax[s], _mm256_add_epi32(
+          _mm256_sub_epi32(cmax, allmin), vmin[s]));
+      __m256i same = _mm256_and_si256(_mm256_cmpeq_epi32(newmin[s], vmin[s]),
+                                      _mm256_cmpeq_epi32(newmax[s], vmax[s]));
+      diff[s] = _mm256_andnot_si256(same, mask[s]);
+      any = _mm256_or_si256(any, diff[s]);
+    }
+    if (_mm256_testz_si256(any, any)) {
+      return true;
+    }
+    for (int s = 0; s < kSlots; s++) {
+      int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(diff[s]));
+      if (lanes == 0) {
+        continue;
+      }
+      alignas(32) int nmin[8], nmax[8];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(nmin), newmin[s]);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(nmax), newmax[s]);
+      for (int lane = 0; lane < 8; lane++) {
+        if ((lanes >> lane & 1) &&
+            !narrow(state, cqueue, index[s][k + lane] / 2,
+                    nmin[lane], nmax[lane])) {
+          cqueue->set_conflict_part(k + lane);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+#endif
+
+  // Updates the sums of a block, the last one being possibly shorter.
+  bool sweep_block(State* state, ConstraintQueue* cqueue, int block) const {
+    int k = block * kBlock;
+    int end = std::min(k + kBlock, int(lmin.size()));
+#ifdef CONSTRAINT_AVX2
+    if (avx2 && end - k == kBlock) {
+      return update_block(state, cqueue, k);
+    }
+#endif
+    for (; k < end; k++) {
+      if (!update_sum(state, cqueue, k)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ public:
+  BulkLinearConstraint() : avx2(false) {
+#ifdef CONSTRAINT_AVX2
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+  }
+  virtual ~BulkLinearConstraint() {}
+
+  // Adds a sum of the given variables, which is the next part of the
+  // constraint. Returns false, adding nothing, if they do not fit in a sum.
+  bool add_sum(int lmin_, int lmax_, const std::vector<VariableId>& vars) {
+    if (int(vars.size()) > kSlots) {
+      return false;
+    }
+    int k = lmin.size();
+    lmin.push_back(lmin_);
+    lmax.push_back(lmax_);
+    for (int s = 0; s < kSlots; s++) {
+      bool used = s < int(vars.size());
+      int id = used ? int(vars[s]) : 0;
+      index[s].push_back(2 * id);
+      valid[s].push_back(used ? -1 : 0);
+      if (!used) {
+        continue;
+      }
+      if (int(count.size()) <= id) {
+        count.resize(id + 1, 0);
+        blocks.resize(id + 1);
+      }
+      if (count[id]++ == 0) {
+        variables.push_back(id);
+      }
+      if (blocks[id].empty() || blocks[id].back() != k / kBlock) {
+        blocks[id].push_back(k / kBlock);
+      }
+    }
+    return true;
+  }
+
+  virtual const std::vector<VariableId>& get_variables() const {
+    return variables;
+  }
+
+  virtual int degree(VariableId var) const {
+    return count[var];
+  }
+
+  virtual bool split_variables(
+      std::vector<std::vector<VariableId>>* groups) const {
+    for (int k = 0; k < int(lmin.size()); k++) {
+      std::vector<VariableId> group;
+      for (int s = 0; s < kSlots && valid[s][k]; s++) {
+        group.push_back(index[s][k] / 2);
+      }
+      groups->push_back(group);
+    }
+    return true;
+  }
+
+  virtual uint64_t fingerprint() const {
+    uint64_t h = 0;
+    for (int k = 0; k < int(lmin.size()); k++) {
+      h = mix_bounds(h, lmin[k], lmax[k]);
+      for (int s = 0; s < kSlots && valid[s][k]; s++) {
+        h = mix_hash(h ^ uint32_t(index[s][k]));
+      }
+    }
+    return h;
+  }
+
+  virtual bool tracks_changes() const {
+    return true;
+  }
+
+  virtual int parts() const {
+    return lmin.size();
+  }
+
+  virtual bool update_constraint(State *state, ConstraintQueue* cqueue) const {
+    int nblocks = (lmin.size() + kBlock - 1) / kBlock;
+    std::vector<uint64_t> dirty((nblocks + 63) / 64);
+    std::vector<VariableId>* changes = cqueue->changed_variables();
+    while (!changes->empty()) {
+      for (VariableId var : *changes) {
+        for (int block : blocks[var]) {
+          dirty[block / 64] |= uint64_t(1) << (block % 64);
+        }
+      }
+      changes->clear();
+      for (int w = 0; w < int(dirty.size()); w++) {
+        for (; dirty[w] != 0; dirty[w] &= dirty[w] - 1) {
+          int block = w * 64 + __builtin_ctzll(dirty[w]);
+          if (!sweep_block(state, cqueue, block)) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+};
+
+template<typename T>
+void write_value(FILE* f, const T& value) {
+  fwrite(&value, sizeof(T), 1, f);
+}
+
+template<typename T>
+bool read_value(FILE* f, T* value) {
+  return fread(value, sizeof(T), 1, f) == 1;
+}
+
+template<typename T>
+void write_vector(FILE* f, const std::vector<T>& v) {
+  write_value(f, int(v.size()));
+  fwrite(v.data(), sizeof(T), v.size(), f);
+}
+
+template<typename T>
+bool read_vector(FILE* f, std::vector<T>* v) {
+  int size = 0;
+  if (!read_value(f, &size) || size < 0) {
+    return false;
+  }
+  v->resize(size);
+  return int(fread(v->data(), sizeof(T), size, f)) == size;
+}
+
+// True if all the ids belong to a model with nvars variables.
+inline bool valid_ids(const std::vector<VariableId>& ids, int nvars) {
+  for (VariableId id : ids) {
+    if (id < 0 || id >= nvars) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const char kCheckpointMagic[4] = {'C', 'C', 'K', 'P'};
+
+// One level of the explicit search stack. A branch frame tries each value
+// of the chosen variable in turn, while a split frame solves each
+// independent component in turn. Both restore bkp when they fail.
+struct SearchFrame {
+  bool split;
+  bool decompose;
+  // There is a split above, whose fallback may reach this state again.
+  bool remember;
+  int depth;
+  std::vector<VariableId> free;
+  std::vector<Bounds> bkp;
+  StateHash hash;
+  int nodes;
+  VariableId index;
+  int value;
+  std::vector<std::vector<VariableId>> comps;
+  int current;
+  std::vector<Bounds> merged;
+  // The components were projected exactly, so the merged solution needs
+  // no further check.
+  bool exact;
+
+  SearchFrame()
+      : split(false), decompose(true), remember(false), depth(0),
+        hash{0, 0}, nodes(0),
+        value(0), current(0), exact(false) {}
+
+  void write(FILE* f) const {
+    write_value(f, split);
+    write_value(f, decompose);
+    write_value(f, remember);
+    write_value(f, depth);
+    write_vector(f, free);
+    write_vector(f, bkp);
+    write_value(f, nodes);
+    write_value(f, index);
+    write_value(f, value);
+    write_value(f, int(comps.size()));
+    for (const auto& comp : comps) {
+      write_vector(f, comp);
+    }
+    write_value(f, current);
+    write_vector(f, merged);
+    write_value(f, exact);
+  }
+
+  // Fails on a frame that does not fit a model with nvars variables.
+  bool read(FILE* f, int nvars) {
+    int ncomps = 0;
+    if (!(read_value(f, &split) && read_value(f, &decompose) &&
+          read_value(f, &remember) && read_value(f, &depth) &&
+          read_vector(f, &free) && read_vector(f, &bkp) &&
+          read_value(f, &nodes) && read_value(f, &index) &&
+          read_value(f, &value) && read_value(f, &ncomps) && ncomps >= 0)) {
+      return false;
+    }
+    comps.resize(ncomps);
+    for (auto& comp : comps) {
+      if (!read_vector(f, &comp) || !valid_ids(comp, nvars)) {
+        return false;
+      }
+    }
+    if (!(read_value(f, &current) && read_vector(f, &merged) &&
+          read_value(f, &exact) && valid_ids(free, nvars) &&
+          int(bkp.size()) == nvars)) {
+      return false;
+    }
+    if (split) {
+      return current >= 0 && current < ncomps && int(merged.size()) == nvars;
+    }
+    return index >= 0 && index < nvars;
+  }
+};
+
+// Components handed by split_parallel to the worker pool. Each worker
+// takes the next component until none is left or one has no solution.
+struct ParallelJob {
+  const std::vector<std::vector<VariableId>>* comps;
+  int depth;
+  const std::vector<Bounds>* start;
+  std::vector<Bounds>* merged;
+  std::atomic<int> next;
+  std::atomic<bool> failed;
+};
+
+// A solver is kIdle until begin(), so a search that never ran is not paused.
+// A paused search whose checkpoint could not be saved is kAborted.
+enum SearchStatus { kIdle, kPaused, kSolved, kFailed, kAborted };
+
+enum SearchStep { kEnter, kNext, kSucceed, kFail, kDone };
+
 class ConstraintSolver {
-  int recursion_nodes, constraints_checked;
+  int recursion_nodes, constraints_checked, decompositions;
+  int decompose_interval;
+  bool parallel;
   State* state;
   ConstraintQueue* cqueue;
-  std::vector<Variable> variables;
+  Tracer* tracer;
+  TranspositionTable* transposition;
+  const char* checkpoint;
+  int checkpoint_nodes;
+  SearchStatus status;
+  uint64_t model;
+  int root_depth;
+  std::vector<VariableId> root_scope;
+  std::vector<SearchFrame> stack;
+  // Workers share the variables of the solver that created them.
+  std::vector<Variable> own_variables;
+  std::vector<Variable>& variables;
   std::vector<const ExternalConstraint*> external;
   std::vector<const TightenConstraint*> tighten;
+  // Trace label of the first part of each constraint, after all the ids
+  // of whole constraints.
+  std::vector<int> part_labels;
+  int next_part_label;
+  // Pool of workers for split_parallel, started on the first parallel
+  // split and stopped when solve() returns.
+  std::vector<std::unique_ptr<ConstraintSolver>> workers;
+  std::vector<std::thread> threads;
+  std::mutex pool_lock;
+  std::condition_variable pool_wake, pool_done;
+  int pool_round, pool_running;
+  bool pool_stop;
+  ParallelJob job;
+
+  // Worker number index, used to solve components in another thread.
+  ConstraintSolver(const ConstraintSolver* parent, int index)
+      : recursion_nodes(0), constraints_checked(0), decompositions(0),
+        decompose_interval(parent->decompose_interval), parallel(false),
+        state(new State(parent->variables, false)), cqueue(nullptr),
+        tracer(parent->tracer ?
+               new Tracer(parent->tracer->get_file(), index + 1) : nullptr),
+        transposition(nullptr), checkpoint(nullptr), checkpoint_nodes(-1),
+        status(kIdle), model(parent->model), root_depth(0),
+        variables(parent->variables), external(parent->external),
+        tighten(parent->tighten), part_labels(parent->part_labels),
+        next_part_label(parent->next_part_label), pool_round(0),
+        pool_running(0), pool_stop(false) {
+    cqueue = new ConstraintQueue(variables, tighten);
+    cqueue->clear();
+  }
  public:
   ConstraintSolver() 
-      : recursion_nodes(0), constraints_checked(0), 
-        state(nullptr), cqueue(nullptr) {}
+      : recursion_nodes(0), constraints_checked(0), decompositions(0),
+        decompose_interval(0), parallel(false),
+        state(nullptr), cqueue(nullptr), tracer(nullptr),
+        transposition(nullptr), checkpoint(nullptr), checkpoint_nodes(-1),
+        status(kIdle), model(0), root_depth(0), variables(own_variables),
+        next_part_label(kPartLabels), pool_round(0), pool_running(0),
+        pool_stop(false) {}
   ~ConstraintSolver() { 
+    stop_pool();
     delete state;
     delete cqueue;
+    delete tracer;
+    delete transposition;
   }
 
   int create_variable(int lmin, int lmax) {
@@ -208,6 +808,7 @@ class ConstraintSolver {
     v.lmin = lmin;
     v.lmax = lmax;
     v.id = variables.size();
+    v.degree = 0;
     variables.push_back(v);
     return variables.size() - 1;
   }
@@ -220,103 +821,639 @@ class ConstraintSolver {
     return state->value(id);
   }
 
-  void add_constraint(const TightenConstraint* cons) {
+  int add_constraint(const TightenConstraint* cons) {
     int id = tighten.size();
     tighten.push_back(cons);
+    part_labels.push_back(next_part_label);
+    next_part_label += cons->parts();
     for (const VariableId& var : cons->get_variables()) {
       variables[var].constraints.push_back(id);
+      variables[var].degree += cons->degree(var);
     }
+    return id;
+  }
+
+  // Record the search tree into file. Only has effect when compiled
+  // with CONSTRAINT_TRACE.
+  void set_trace(TraceFile* file) {
+#ifdef CONSTRAINT_TRACE
+    delete tracer;
+    tracer = new Tracer(file);
+#endif
+  }
+
+  // Position of a constraint in the grid, used to map the trace back.
+  void label_constraint(int id, int y, int x) {
+    TRACE(tracer, record(kLabel, id, y << 16 | x));
+  }
+
+  // Position of a part of a constraint, which must be complete when added.
+  void label_part(int id, int part, int y, int x) {
+    TRACE(tracer, record(kLabel, part_labels[id] + part, y << 16 | x));
+  }
+
+  // Look for independent components of the free variables on every node
+  // whose depth is a multiple of interval, and optionally solve them in
+  // parallel. An interval of zero disables the decomposition.
+  void set_decomposition(int interval, bool parallel_) {
+    decompose_interval = interval;
+    parallel = parallel_;
+  }
+
+  // Remember the states proven to have no solution, using at most the
+  // given number of bytes. A state is only reached twice when the
+  // solution merged from a split is rejected and its components are
+  // searched again together, so the table only does something with a
+  // sequential decomposition, and nothing at all otherwise.
+  void set_transposition(size_t bytes) {
+    delete transposition;
+    transposition = new TranspositionTable(bytes);
+  }
+
+  // Write a checkpoint of the search into filename every max_nodes
+  // nodes, and resume from it if it already exists. The file is removed
+  // once the search ends. A negative max_nodes runs the search to the end,
+  // while zero would pause before making any progress.
+  void set_checkpoint(const char* filename, int max_nodes) {
+    checkpoint = filename;
+    checkpoint_nodes = max_nodes;
+  }
+
+  bool paused() const {
+    return status == kPaused;
+  }
+
+  bool aborted() const {
+    return status == kAborted;
   }
 
   bool solve() {
-    state = new State(variables);
+    auto start = std::chrono::steady_clock::now();
+    begin();
+    auto root = std::chrono::steady_clock::now();
     std::cout << "Variables: " << variables.size() << "\n";
     std::cout << "Constraints: " << tighten.size() << "\n";
-    cqueue = new ConstraintQueue(variables, tighten);
-    tight();
-    int freevars = 0;
-    for (const auto& var : variables) {
-      if (!state->fixed(var.id)) {
-        freevars++;
-      }
+    std::cout << "Free variables: " << free_variables(root_scope).size()
+              << "\n";
+    if (checkpoint != nullptr && load_checkpoint(checkpoint)) {
+      std::cout << "Resumed from " << checkpoint << "\n";
     }
-    std::cout << "Free variables: " << freevars << "\n";
-    bool result = recursion();
+    int resumed_nodes = recursion_nodes;
+    search(checkpoint != nullptr ? checkpoint_nodes : -1);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::micro> root_time = root - start;
+    std::chrono::duration<double, std::micro> search_time = end - root;
+    std::cout << "Root propagation: " << root_time.count() << " us\n";
+    int searched = std::max(1, recursion_nodes - resumed_nodes);
+    std::cout << "Time per node: " << search_time.count() / searched
+              << " us\n";
     std::cout << "Recursion nodes: " << recursion_nodes << "\n";
     std::cout << "Constraints checked: " << constraints_checked << "\n";
+    std::cout << "Decompositions: " << decompositions << "\n";
+    stop_pool();
+    if (transposition != nullptr) {
+      transposition->report();
+    }
+    if (status == kPaused) {
+      if (!save_checkpoint(checkpoint)) {
+        std::cerr << "Cannot save checkpoint to " << checkpoint << "\n";
+        status = kAborted;
+        return false;
+      }
+      std::cout << "Search paused, checkpoint saved to " << checkpoint << "\n";
+      return false;
+    }
+    if (checkpoint != nullptr) {
+      remove(checkpoint);
+    }
+    bool result = status == kSolved;
     std::cout << "Solution " << (result ? "" : "not ") << "found\n";
     return result;
   }
 
-  bool recursion() {
+  // Prepares the search from the root, after the first propagation.
+  void begin() {
+    delete state;
+    delete cqueue;
+    state = new State(variables, transposition != nullptr);
+    cqueue = new ConstraintQueue(variables, tighten);
+    recursion_nodes = constraints_checked = decompositions = 0;
+    tight();
+    model = fingerprint();
+    root_scope.clear();
+    for (const auto& var : variables) {
+      root_scope.push_back(var.id);
+    }
+    root_depth = 0;
+    stack.clear();
+    status = kPaused;
+  }
+
+  // Runs the search for at most max_nodes nodes, or until it ends when
+  // max_nodes is negative. The search can be resumed with another call
+  // as long as the result is kPaused.
+  SearchStatus search(int max_nodes) {
+    if (status != kPaused) {
+      return status;
+    }
+    SearchStep step = kEnter;
+    int visited = 0;
+    while (true) {
+      if (step == kEnter) {
+        if (visited == max_nodes) {
+          return status;
+        }
+        visited++;
+        step = enter();
+      } else if (step == kNext) {
+        step = next_value();
+      } else if (step == kSucceed) {
+        step = succeed();
+      } else {
+        step = fail();
+      }
+      if (step == kDone) {
+        if (status == kSolved) {
+          state->save_solution();
+        }
+        return status;
+      }
+    }
+  }
+
+  // Writes into a temporary file that then replaces filename, so a run
+  // killed while saving keeps the previous checkpoint.
+  bool save_checkpoint(const char* filename) {
+    std::string temp = std::string(filename) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (f == nullptr) {
+      return false;
+    }
+    fwrite(kCheckpointMagic, 1, sizeof(kCheckpointMagic), f);
+    write_value(f, int(variables.size()));
+    write_value(f, model);
+    write_value(f, recursion_nodes);
+    write_value(f, constraints_checked);
+    write_value(f, decompositions);
+    write_value(f, root_depth);
+    write_vector(f, root_scope);
+    write_vector(f, state->get_variables());
+    write_value(f, int(stack.size()));
+    for (const SearchFrame& frame : stack) {
+      frame.write(f);
+    }
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temp.c_str(), filename) != 0) {
+      remove(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // Restores a search saved from the same model. Must follow begin().
+  bool load_checkpoint(const char* filename) {
+    FILE *f = fopen(filename, "rb");
+    if (f == nullptr) {
+      return false;
+    }
+    char magic[4];
+    int nvars = 0, nframes = 0;
+    uint64_t saved_model = 0;
+    std::vector<Bounds> bounds;
+    bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+              std::equal(magic, magic + 4, kCheckpointMagic) &&
+              read_value(f, &nvars) && nvars == int(variables.size()) &&
+              read_value(f, &saved_model) && saved_model == model &&
+              read_value(f, &recursion_nodes) &&
+              read_value(f, &constraints_checked) &&
+              read_value(f, &decompositions) &&
+              read_value(f, &root_depth) &&
+              read_vector(f, &root_scope) && valid_ids(root_scope, nvars) &&
+              read_vector(f, &bounds) && int(bounds.size()) == nvars &&
+              read_value(f, &nframes) && nframes >= 0;
+    stack.resize(ok ? nframes : 0);
+    for (int i = 0; ok && i < nframes; i++) {
+      ok = stack[i].read(f, nvars);
+    }
+    fclose(f);
+    if (!ok) {
+      std::cerr << "Ignoring checkpoint " << filename
+                << ", saved from another model or corrupt\n";
+      begin();
+      return false;
+    }
+    // The frame hashes are not saved, since the run that saved them may
+    // not have been hashing.
+    for (SearchFrame& frame : stack) {
+      state->set_variables(frame.bkp);
+      frame.hash = state->get_hash();
+    }
+    state->set_variables(bounds);
+    status = kPaused;
+    return true;
+  }
+
+  // A search node. On kEnter the scope comes from the frame on top.
+  SearchStep enter() {
     recursion_nodes++;
-    if (finished()) {      
-      state->save_solution();
-      return true;
+    int depth = root_depth;
+    bool decompose = true;
+    bool remember = false;
+    const std::vector<VariableId>* scope = &root_scope;
+    if (!stack.empty()) {
+      const SearchFrame& top = stack.back();
+      depth = top.depth + 1;
+      remember = top.remember || top.split;
+      if (top.split) {
+        scope = &top.comps[top.current];
+      } else {
+        scope = &top.free;
+        decompose = top.decompose;
+      }
     }
-    VariableId index = choose();
-    std::vector<Bounds> bkp = state->get_variables();
-    int savemin = state->read_lmin(index), savemax = state->read_lmax(index);
-    for (int i = savemin; i <= savemax; i++) {
-      state->set_variables(bkp);
-      state->change_var(index, i, i);
-      cqueue->push_variable(index);
-      if (tight() && valid()) {
-        if (recursion()) {
-          return true;
+    // Only the fallback of a rejected split can find a known state.
+    if (!decompose && transposition != nullptr &&
+        transposition->failed(state->get_hash())) {
+      return kFail;
+    }
+    std::vector<VariableId> free = free_variables(*scope);
+    if (free.empty()) {
+      TRACE(tracer, record(kSolution, 0));
+      return kSucceed;
+    }
+    if (decompose && decompose_interval > 0 &&
+        depth % decompose_interval == 0) {
+      bool exact = true;
+      std::vector<std::vector<VariableId>> comps = components(free, &exact);
+      if (comps.size() >= 2) {
+        decompositions++;
+        TRACE(tracer, record(kSplit, comps.size()));
+        if (!parallel) {
+          SearchFrame frame;
+          frame.split = true;
+          frame.remember = remember;
+          frame.depth = depth;
+          frame.free = std::move(free);
+          frame.bkp = state->get_variables();
+          frame.hash = state->get_hash();
+          frame.nodes = recursion_nodes;
+          frame.comps = std::move(comps);
+          frame.merged = frame.bkp;
+          frame.exact = exact;
+          stack.push_back(std::move(frame));
+          return kEnter;
+        }
+        bool solved = false;
+        int nodes = recursion_nodes;
+        if (!split_parallel(comps, depth, exact, &solved)) {
+          if (remember && transposition != nullptr) {
+            transposition->store(state->get_hash(), recursion_nodes - nodes);
+          }
+          return kFail;
         }
+        if (solved) {
+          return kSucceed;
+        }
+        decompose = false;
       }
     }
-    state->set_variables(bkp);
-    return false;
+    SearchFrame frame;
+    frame.depth = depth;
+    frame.decompose = decompose;
+    frame.remember = remember;
+    frame.bkp = state->get_variables();
+    frame.hash = state->get_hash();
+    frame.nodes = recursion_nodes;
+    frame.index = choose(free);
+    frame.free = std::move(free);
+    frame.value = state->read_lmin(frame.index);
+    stack.push_back(std::move(frame));
+    return kNext;
   }
 
-  bool valid() {
-    for (auto& cons : external) {
-      if (!(*cons)(state)) {
-        return false;
+  // Tries the next value of the variable chosen on the frame on top.
+  SearchStep next_value() {
+    SearchFrame& top = stack.back();
+    while (top.value <= top.bkp[top.index].lmax) {
+      int i = top.value++;
+      state->set_variables(top.bkp, top.hash);
+      state->change_var(top.index, i, i);
+      TRACE(tracer, decision(top.depth, top.index, i));
+      cqueue->push_variable(top.index);
+      if (tight() && valid()) {
+        return kEnter;
       }
     }
+    state->set_variables(top.bkp, top.hash);
+    remember_failure(top);
+    stack.pop_back();
+    return kFail;
+  }
+
+  void remember_failure(const SearchFrame& frame) {
+    if (frame.remember && transposition != nullptr) {
+      transposition->store(frame.hash, recursion_nodes - frame.nodes);
+    }
+  }
+
+  // The node above the frame on top found a solution, which is left in
+  // the state.
+  SearchStep succeed() {
+    while (!stack.empty() && !stack.back().split) {
+      stack.pop_back();
+    }
+    if (stack.empty()) {
+      status = kSolved;
+      return kDone;
+    }
+    SearchFrame& top = stack.back();
+    for (VariableId id : top.comps[top.current]) {
+      top.merged[id] = state->get_variables()[id];
+    }
+    top.current++;
+    if (top.current < int(top.comps.size())) {
+      state->set_variables(top.bkp, top.hash);
+      return kEnter;
+    }
+    state->set_variables(top.merged);
+    if (top.exact || valid()) {
+      stack.pop_back();
+      return kSucceed;
+    }
+    // The combination was rejected, search the components together.
+    state->set_variables(top.bkp, top.hash);
+    top.split = false;
+    top.decompose = false;
+    top.comps.clear();
+    top.merged.clear();
+    top.index = choose(top.free);
+    top.value = state->read_lmin(top.index);
+    return kNext;
+  }
+
+  // The node above the frame on top has no solution.
+  SearchStep fail() {
+    if (stack.empty()) {
+      status = kFailed;
+      return kDone;
+    }
+    SearchFrame& top = stack.back();
+    if (!top.split) {
+      return kNext;
+    }
+    state->set_variables(top.bkp, top.hash);
+    remember_failure(top);
+    stack.pop_back();
+    return kFail;
+  }
+
+  // Solves each independent component in the worker pool, starting from
+  // the current state. Returns false if some component has no solution.
+  // Sets solved when the combined solution was accepted, which is always
+  // the case when exact; otherwise the state is left untouched and must be
+  // searched as a whole.
+  bool split_parallel(const std::vector<std::vector<VariableId>>& comps,
+      int depth, bool exact, bool* solved) {
+    start_pool();
+    std::vector<Bounds> start = state->get_variables();
+    std::vector<Bounds> merged = start;
+    {
+      std::lock_guard<std::mutex> guard(pool_lock);
+      job.comps = &comps;
+      job.depth = depth;
+      job.start = &start;
+      job.merged = &merged;
+      job.next = 0;
+      job.failed = false;
+      pool_running = threads.size();
+      pool_round++;
+    }
+    pool_wake.notify_all();
+    {
+      std::unique_lock<std::mutex> guard(pool_lock);
+      pool_done.wait(guard, [this]() { return pool_running == 0; });
+    }
+    for (const auto& worker : workers) {
+      recursion_nodes += worker->recursion_nodes;
+      constraints_checked += worker->constraints_checked;
+      decompositions += worker->decompositions;
+      worker->recursion_nodes = 0;
+      worker->constraints_checked = 0;
+      worker->decompositions = 0;
+    }
+    if (job.failed) {
+      state->set_variables(start);
+      return false;
+    }
+    state->set_variables(merged);
+    if (exact || valid()) {
+      *solved = true;
+      return true;
+    }
+    state->set_variables(start);
     return true;
   }
 
-  VariableId choose() {
-    VariableId chosen = 0;
-    int diff = std::numeric_limits<int>::max();
-    for (const Variable& var : variables) {
-      if (!state->fixed(var.id)) {
-        int cur_diff = state->read_lmax(var.id) - state->read_lmin(var.id);
-        if (cur_diff < diff) {
-          chosen = var.id;
-          diff = cur_diff;
-        } else if (cur_diff == diff && 
-            var.constraints.size() > variables[chosen].constraints.size()) {
-          chosen = var.id;
+  void start_pool() {
+    if (!threads.empty()) {
+      return;
+    }
+    int count = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < count; i++) {
+      workers.emplace_back(new ConstraintSolver(this, i));
+    }
+    for (int i = 0; i < count; i++) {
+      threads.emplace_back(&ConstraintSolver::work, this, workers[i].get());
+    }
+  }
+
+  void stop_pool() {
+    if (threads.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(pool_lock);
+      pool_stop = true;
+    }
+    pool_wake.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+    workers.clear();
+    pool_stop = false;
+  }
+
+  // Body of a pool thread: runs worker on each job until the pool stops.
+  void work(ConstraintSolver* worker) {
+    int round = 0;
+    std::unique_lock<std::mutex> guard(pool_lock);
+    while (true) {
+      pool_wake.wait(guard, [&]() {
+        return pool_stop || pool_round != round;
+      });
+      if (pool_stop) {
+        return;
+      }
+      round = pool_round;
+      guard.unlock();
+      worker->solve_components(&job);
+      guard.lock();
+      if (--pool_running == 0) {
+        pool_done.notify_one();
+      }
+    }
+  }
+
+  void solve_components(ParallelJob* job) {
+    const auto& comps = *job->comps;
+    for (int i = job->next++; i < int(comps.size()) && !job->failed;
+         i = job->next++) {
+      state->set_variables(*job->start);
+      root_scope = comps[i];
+      root_depth = job->depth + 1;
+      stack.clear();
+      status = kPaused;
+      if (search(-1) != kSolved) {
+        job->failed = true;
+        return;
+      }
+      for (VariableId id : comps[i]) {
+        (*job->merged)[id] = state->get_variables()[id];
+      }
+    }
+  }
+
+  // Groups the free variables into components that share no constraint.
+  // Clears exact if some external constraint must check the combination.
+  std::vector<std::vector<VariableId>> components(
+      const std::vector<VariableId>& free, bool* exact) {
+    std::vector<int> parent(variables.size(), -1);
+    for (VariableId id : free) {
+      parent[id] = id;
+    }
+    auto find = [&](int id) {
+      while (parent[id] != id) {
+        parent[id] = parent[parent[id]];
+        id = parent[id];
+      }
+      return id;
+    };
+    auto join = [&](const std::vector<VariableId>& group) {
+      int first = -1;
+      for (VariableId id : group) {
+        if (parent[id] < 0) {
+          continue;
+        }
+        if (first < 0) {
+          first = find(id);
+        } else {
+          parent[find(id)] = first;
+        }
+      }
+    };
+    std::vector<std::vector<VariableId>> groups;
+    std::vector<bool> visited(tighten.size(), false);
+    for (VariableId id : free) {
+      for (int cons : variables[id].constraints) {
+        if (!visited[cons]) {
+          visited[cons] = true;
+          if (!tighten[cons]->split_variables(&groups)) {
+            join(tighten[cons]->get_variables());
+          }
         }
       }
     }
-    return chosen;
+    for (auto& cons : external) {
+      if (!cons->project(state, &groups)) {
+        *exact = false;
+      }
+    }
+    for (const auto& group : groups) {
+      join(group);
+    }
+    std::vector<int> index(variables.size(), -1);
+    std::vector<std::vector<VariableId>> comps;
+    for (VariableId id : free) {
+      int root = find(id);
+      if (index[root] < 0) {
+        index[root] = comps.size();
+        comps.push_back(std::vector<VariableId>());
+      }
+      comps[index[root]].push_back(id);
+    }
+    return comps;
   }
 
-  bool finished() {
-    for (const Variable& var : variables) {
-      if (!state->fixed(var.id)) {
+  // Hash of the model and of its bounds after the root propagation.
+  uint64_t fingerprint() const {
+    uint64_t h = mix_hash(variables.size());
+    for (const Bounds& b : state->get_variables()) {
+      h = mix_bounds(h, b.lmin, b.lmax);
+    }
+    for (const TightenConstraint* cons : tighten) {
+      h = mix_hash(h ^ cons->fingerprint());
+    }
+    return h;
+  }
+
+  bool valid() {
+    for (int i = 0; i < int(external.size()); i++) {
+      if (!(*external[i])(state)) {
+        TRACE(tracer, record(kRejected, i));
         return false;
       }
     }
     return true;
   }
 
+  std::vector<VariableId> free_variables(const std::vector<VariableId>& scope) {
+    std::vector<VariableId> free;
+    for (VariableId id : scope) {
+      if (!state->fixed(id)) {
+        free.push_back(id);
+      }
+    }
+    return free;
+  }
+
+  VariableId choose(const std::vector<VariableId>& free) {
+    VariableId chosen = free[0];
+    int diff = std::numeric_limits<int>::max();
+    for (VariableId id : free) {
+      int cur_diff = state->read_lmax(id) - state->read_lmin(id);
+      if (cur_diff < diff) {
+        chosen = id;
+        diff = cur_diff;
+      } else if (cur_diff == diff && 
+          variables[id].degree > variables[chosen].degree) {
+        chosen = id;
+      }
+    }
+    return chosen;
+  }
+
+  // Label of the failing part of the constraint, if it told which.
+  int conflict_label(int id) const {
+    int part = cqueue->conflict_part();
+    return part < 0 ? id : part_labels[id] + part;
+  }
+
   bool tight() {
+    int checked = 0;
     while (!cqueue->empty()) {
       int id = cqueue->pop_constraint();
-      constraints_checked++;
+      checked++;
       if (!tighten[id]->update_constraint(state, cqueue)) {
+        constraints_checked += checked;
+        TRACE(tracer, record(kConflict, conflict_label(id), checked));
         cqueue->clear();
         return false;
       }
     }
+    constraints_checked += checked;
+    TRACE(tracer, record(kPropagated, checked));
     return true;
   }
 };
-
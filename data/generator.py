@@ -0,0 +1,137 @@
+"""Generates random Slither and Hashi puzzles of any size.
+
+Usage: generator.py slither|hashi width height density seed
+
+Slither: grows a random region of cells without holes, whose border is a
+single loop, and keeps each cell clue with probability density.
+Hashi: grows a random tree of bridges, sometimes closing cycles, until
+density * width * height islands are placed.
+
+The puzzles always have a solution, but it is not necessarily unique.
+"""
+
+import random
+import sys
+
+DIRS = [(-1, 0), (0, 1), (1, 0), (0, -1)]
+RING = [(-1, 0), (-1, 1), (0, 1), (1, 1), (1, 0), (1, -1), (0, -1), (-1, -1)]
+
+
+def can_add(inside, w, h, y, x):
+  """True if adding the cell keeps the border of the region a single loop."""
+  ring = []
+  for dy, dx in RING:
+    yy, xx = y + dy, x + dx
+    ring.append(0 <= yy < h and 0 <= xx < w and inside[yy][xx])
+  runs = sum(1 for i in range(8) if ring[i] and not ring[i - 1])
+  if runs != 1:
+    return False
+  # A diagonal neighbour touching only by the corner pinches the loop.
+  for i in range(1, 8, 2):
+    if ring[i] and not ring[i - 1] and not ring[(i + 1) % 8]:
+      return False
+  return True
+
+
+# Chance of growing into a cell by its number of neighbours in the region,
+# preferring the cells that make the loop longer.
+WIGGLE = [0, 1, 0.2, 0.02, 0]
+
+
+def neighbours(inside, w, h, y, x):
+  return sum(1 for dy, dx in DIRS
+             if 0 <= y + dy < h and 0 <= x + dx < w and inside[y + dy][x + dx])
+
+
+def slither(w, h, density, rng):
+  inside = [[False] * w for _ in range(h)]
+  inside[rng.randrange(h)][rng.randrange(w)] = True
+  target = w * h // 2
+  size = 1
+  frontier = [(y, x) for y in range(h) for x in range(w)]
+  stalled = 0
+  while size < target and stalled < 20 * w * h:
+    y, x = rng.choice(frontier)
+    if not inside[y][x] and can_add(inside, w, h, y, x) and \
+        rng.random() < WIGGLE[neighbours(inside, w, h, y, x)]:
+      inside[y][x] = True
+      size += 1
+      stalled = 0
+    else:
+      stalled += 1
+  grid = []
+  for y in range(h):
+    row = ""
+    for x in range(w):
+      borders = 0
+      for dy, dx in DIRS:
+        yy, xx = y + dy, x + dx
+        out = not (0 <= yy < h and 0 <= xx < w and inside[yy][xx])
+        borders += inside[y][x] == out
+      row += str(borders) if rng.random() < density else "."
+    grid.append(row)
+  return grid
+
+
+def hashi(w, h, density, rng):
+  cell = [["."] * w for _ in range(h)]
+  size = {}
+  used = set()
+  y, x = rng.randrange(h), rng.randrange(w)
+  cell[y][x] = "o"
+  size[(y, x)] = 0
+  islands = [(y, x)]
+  target = max(2, int(density * w * h))
+  tries = 0
+  while len(islands) < target and tries < 100 * w * h:
+    tries += 1
+    y, x = rng.choice(islands)
+    dy, dx = rng.choice(DIRS)
+    bridges = rng.randint(1, 2)
+    if size[(y, x)] + bridges > 8:
+      continue
+    length = rng.randint(2, max(2, min(w, h) // 2))
+    path = []
+    yy, xx = y + dy, x + dx
+    while 0 <= yy < h and 0 <= xx < w and cell[yy][xx] == "." and \
+        len(path) < length:
+      path.append((yy, xx))
+      yy, xx = yy + dy, xx + dx
+    if 0 <= yy < h and 0 <= xx < w and cell[yy][xx] == "o" and \
+        len(path) < length:
+      # Closes a cycle with an existing island.
+      end = (yy, xx)
+      if size[end] + bridges > 8 or ((y, x), end) in used:
+        continue
+    elif len(path) >= 2:
+      end = path.pop()
+      cell[end[0]][end[1]] = "o"
+      size[end] = 0
+      islands.append(end)
+    else:
+      continue
+    for py, px in path:
+      cell[py][px] = "-" if dy == 0 else "|"
+    size[(y, x)] += bridges
+    size[end] += bridges
+    used.add(((y, x), end))
+    used.add((end, (y, x)))
+  grid = []
+  for y in range(h):
+    grid.append("".join(
+        str(size[(y, x)]) if cell[y][x] == "o" else "." for x in range(w)))
+  return grid
+
+
+def generate(kind, w, h, density, seed):
+  rng = random.Random(seed)
+  grid = (slither if kind == "slither" else hashi)(w, h, density, rng)
+  return "%d %d\n%s\n" % (w, h, "\n".join(grid))
+
+
+if __name__ == "__main__":
+  if len(sys.argv) != 6 or sys.argv[1] not in ("slither", "hashi"):
+    sys.exit(__doc__)
+  sys.stdout.write(generate(sys.argv[1], int(sys.argv[2]),
+                            int(sys.argv[3]), float(sys.argv[4]),
+                            int(sys.argv[5])))
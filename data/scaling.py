@@ -0,0 +1,116 @@
+"""Measures how the solver scales with the board size.
+
+Usage: scaling.py [--kind slither|hashi] [--density D] [--seeds N]
+                  [--timeout T] [sizes...]
+
+Generates square boards of each size with generator.py and runs the
+solver on them, recording wall time, peak memory and recursion nodes.
+Writes scaling.<kind>.csv and, if matplotlib is available, a plot in
+scaling.<kind>.png. Run from the directory with the solver binaries and
+peakmem, which measures the memory of the solver alone.
+"""
+
+import argparse
+import os
+import re
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import generator
+
+
+def kill(proc):
+  try:
+    os.killpg(proc.pid, signal.SIGKILL)
+  except ProcessLookupError:
+    pass
+
+
+def run(solver, puzzle, timeout):
+  """Returns seconds, peak memory in KB and nodes, or None on timeout.
+
+  The solver runs under peakmem, in its own process group so that a
+  timeout kills both.
+  """
+  with open(puzzle) as stdin:
+    start = time.time()
+    proc = subprocess.Popen(["./peakmem", solver], stdin=stdin,
+                            stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL,
+                            start_new_session=True)
+    timer = threading.Timer(timeout, kill, [proc])
+    timer.start()
+    out = proc.communicate()[0].decode()
+    elapsed = time.time() - start
+    timer.cancel()
+  memory = re.search(r"Peak memory: (\d+) KB", out)
+  if proc.returncode < 0 or proc.returncode >= 128 or memory is None:
+    return None
+  nodes = re.search(r"Recursion nodes: (\d+)", out)
+  return elapsed, int(memory.group(1)), nodes and int(nodes.group(1))
+
+
+def main():
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--kind", default="slither",
+                      choices=["slither", "hashi"])
+  parser.add_argument("--density", type=float, default=None)
+  parser.add_argument("--seeds", type=int, default=3)
+  parser.add_argument("--timeout", type=float, default=60)
+  parser.add_argument("sizes", type=int, nargs="*",
+                      default=[10, 20, 30, 40, 50, 60, 80, 100])
+  args = parser.parse_args()
+  density = args.density
+  if density is None:
+    density = 0.8 if args.kind == "slither" else 0.2
+  solver = "./" + args.kind
+  rows = []
+  for size in args.sizes:
+    for seed in range(1, args.seeds + 1):
+      with tempfile.NamedTemporaryFile("w", suffix=".txt",
+                                       delete=False) as f:
+        f.write(generator.generate(args.kind, size, size, density, seed))
+      result = run(solver, f.name, args.timeout)
+      os.unlink(f.name)
+      if result is None:
+        print("%dx%d seed %d: timeout" % (size, size, seed))
+        rows.append((size, seed, None, None, None))
+        continue
+      rows.append((size, seed) + result)
+      print("%dx%d seed %d: %.3fs %dKB %s nodes" %
+            ((size, size) + rows[-1][1:]))
+  name = "scaling.%s" % args.kind
+  with open(name + ".csv", "w") as f:
+    f.write("size,seed,seconds,max_rss_kb,nodes\n")
+    for row in rows:
+      f.write(",".join("" if v is None else str(v) for v in row) + "\n")
+  plot(name, rows)
+
+
+def plot(name, rows):
+  try:
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+  except ImportError:
+    print("matplotlib not found, skipping %s.png" % name)
+    return
+  done = [row for row in rows if row[2] is not None]
+  fig, axes = plt.subplots(1, 3, figsize=(15, 4))
+  for ax, column, label in zip(axes, [2, 3, 4],
+                               ["time (s)", "max RSS (KB)", "nodes"]):
+    ax.scatter([row[0] for row in done], [row[column] for row in done])
+    ax.set_xlabel("board size")
+    ax.set_ylabel(label)
+    ax.set_yscale("log")
+  fig.tight_layout()
+  fig.savefig(name + ".png")
+
+
+if __name__ == "__main__":
+  main()
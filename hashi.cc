@@ -6,7 +6,11 @@
 #include <cstdio>
 #include <limits>
 #include <queue>
+#include <memory>
+#include <cstdlib>
+#include <unistd.h>
 #include "constraint.h"
+#include "cache.h"
 
 using namespace std;
 
@@ -59,6 +63,12 @@ class SingleGroupConstraint : public ExternalConstraint {
     }
     return true;
   }
+
+  // Connectivity may only be checked on the combined solution.
+  virtual bool project(const State* state,
+      vector<vector<VariableId>>* groups) const {
+    return false;
+  }
 };
 
 class NoCrossConstraint : public ExternalConstraint {
@@ -78,6 +88,19 @@ class NoCrossConstraint : public ExternalConstraint {
     }
     return true;
   }
+
+  // Crossing links must be decided in the same component.
+  virtual bool project(const State* state,
+      vector<vector<VariableId>>* groups) const {
+    for (const auto& link : links) {
+      for (int other : link.forbidden) {
+        if (!state->fixed(link.id) && !state->fixed(other)) {
+          groups->push_back({link.id, other});
+        }
+      }
+    }
+    return true;
+  }
 };
 
 class HashiSolver {
@@ -86,6 +109,7 @@ class HashiSolver {
   const vector<string>& grid;
   vector<Node> nodes;
   vector<Link> links;
+  vector<int> values;
   ConstraintSolver solver;
 
  public:
@@ -93,6 +117,30 @@ class HashiSolver {
       : width(width_), height(height_), grid(grid_) {
   }
 
+  void trace(TraceFile* file) {
+    solver.set_trace(file);
+  }
+
+  void checkpoint(const char* filename, int max_nodes) {
+    solver.set_checkpoint(filename, max_nodes);
+  }
+
+  void transposition(size_t bytes) {
+    solver.set_transposition(bytes);
+  }
+
+  void decomposition(int interval, bool parallel) {
+    solver.set_decomposition(interval, parallel);
+  }
+
+  bool paused() const {
+    return solver.paused();
+  }
+
+  bool aborted() const {
+    return solver.aborted();
+  }
+
   template<typename T>
   void for_all_digits(T callback) {
     for (int j = 0; j < height; j++) {
@@ -148,7 +196,7 @@ class HashiSolver {
     }
   }
 
-  void solve() {
+  bool solve() {
     for (auto& link : links) {
       link.id = solver.create_variable(0, 2);
     }
@@ -159,7 +207,8 @@ class HashiSolver {
         cons->add_variable(links[link].id);
       }
       linear.push_back(cons);
-      solver.add_constraint(cons);
+      int id = solver.add_constraint(cons);
+      solver.label_constraint(id, 2 * n.y, 2 * n.x);
     }
     if (nodes.size() > 2) {
       for (const auto& link : links) {
@@ -168,7 +217,10 @@ class HashiSolver {
           int size = nodes[link.a].size;
           auto cons = new LinearConstraint(0, size - 1);
           cons->add_variable(link.id);
-          solver.add_constraint(cons);
+          int id = solver.add_constraint(cons);
+          // Doubled coordinates, so midpoints fall between the islands.
+          solver.label_constraint(id, nodes[link.a].y + nodes[link.b].y,
+                                  nodes[link.a].x + nodes[link.b].x);
         }
       }
     }
@@ -176,16 +228,49 @@ class HashiSolver {
     solver.add_external_constraint(&no_cross);
     SingleGroupConstraint single_group(nodes, links);
     solver.add_external_constraint(&single_group);
-    solver.solve();
+    if (!solver.solve()) {
+      return false;
+    }
+    values.resize(links.size());
     for (const auto& link : links) {
-      auto var = solver.value(link.id);
-      cout << "solution from node " << nodes[link.a].size
-           << " to " << nodes[link.b].size << " is " 
-           << "(" << var << ")\n";
+      values[link.id] = solver.value(link.id);
+    }
+    return true;
+  }
+
+  // The solution in a grid with twice the resolution, where each link
+  // is stored along its path. Crossing links can't both be used, so the
+  // cells next to the nodes are enough to read it back.
+  vector<string> solution_grid() {
+    vector<string> solution(2 * height - 1, string(2 * width - 1, '.'));
+    for (const auto& link : links) {
+      const Node& a = nodes[link.a];
+      const Node& b = nodes[link.b];
+      int dy = link.horizontal ? 0 : 1, dx = link.horizontal ? 1 : 0;
+      for (int y = 2 * a.y + dy, x = 2 * a.x + dx;
+           y < 2 * b.y || x < 2 * b.x; y += dy, x += dx) {
+        solution[y][x] = max<char>(solution[y][x], '0' + values[link.id]);
+      }
+    }
+    return solution;
+  }
+
+  void load_solution(const vector<string>& solution) {
+    values.resize(links.size());
+    for (const auto& link : links) {
+      const Node& a = nodes[link.a];
+      int y = 2 * a.y + (link.horizontal ? 0 : 1);
+      int x = 2 * a.x + (link.horizontal ? 1 : 0);
+      values[link.id] = solution[y][x] - '0';
     }
   }
 
   void print() {
+    for (const auto& link : links) {
+      cout << "solution from node " << nodes[link.a].size
+           << " to " << nodes[link.b].size << " is " 
+           << "(" << values[link.id] << ")\n";
+    }
     FILE *f = fopen("hashi.dot", "wt");
     fprintf(f, "graph {\n");
     for (const auto& n : nodes) {
@@ -193,7 +278,7 @@ class HashiSolver {
               n.id, n.size, n.size, n.x, height - n.y - 1);
     }
     for (const auto& link : links) {
-      for (int i = 1; i <= solver.value(link.id); i++) {
+      for (int i = 1; i <= values[link.id]; i++) {
         fprintf(f, "n%d_%d -- n%d_%d;\n", 
                 link.a, nodes[link.a].size,
                 link.b, nodes[link.b].size);
@@ -204,7 +289,50 @@ class HashiSolver {
   }
 };
 
-int main() {
+// Usage: hashi [-t trace] [-c checkpoint [-n nodes]] [-s cache] [-m megabytes]
+//     [-d interval [-p]] < puzzle
+// Tracing with -t is only available in the -trace builds.
+// With a checkpoint the search pauses after the given number of nodes,
+// saves the checkpoint and exits with 2, or with 1 if it cannot be saved;
+// run again to resume. Solutions are kept in the cache file and reused for
+// rotations and reflections.
+// With -m, failed states are remembered in a table of that size, which
+// only helps with -d and without -p. With -d, independent parts of the
+// board are solved apart every interval levels, in parallel with -p.
+int main(int argc, char **argv) {
+  const char *trace_file = nullptr, *checkpoint_file = nullptr;
+  const char *cache_file = nullptr;
+  int max_nodes = -1, megabytes = 0, interval = 0;
+  bool parallel = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:n:s:m:d:p")) != -1) {
+    if (opt == 't') {
+#ifdef CONSTRAINT_TRACE
+      trace_file = optarg;
+#else
+      cerr << "-t needs a build with -DCONSTRAINT_TRACE, see hashi-trace\n";
+      return 1;
+#endif
+    } else if (opt == 'c') {
+      checkpoint_file = optarg;
+    } else if (opt == 'n') {
+      max_nodes = atoi(optarg);
+      if (max_nodes <= 0) {
+        cerr << "-n needs a positive number of nodes\n";
+        return 1;
+      }
+    } else if (opt == 's') {
+      cache_file = optarg;
+    } else if (opt == 'm') {
+      megabytes = atoi(optarg);
+    } else if (opt == 'd') {
+      interval = atoi(optarg);
+    } else if (opt == 'p') {
+      parallel = true;
+    } else {
+      return 1;
+    }
+  }
   int width, height;
   cin >> width;
   cin >> height;
@@ -212,9 +340,37 @@ int main() {
   for (int i = 0; i < height; i++) {
     cin >> grid[i];
   }
+  unique_ptr<TraceFile> trace(
+      trace_file != nullptr ? new TraceFile(trace_file) : nullptr);
   HashiSolver s(width, height, grid);
+  if (trace) {
+    s.trace(trace.get());
+  }
+  if (checkpoint_file != nullptr) {
+    s.checkpoint(checkpoint_file, max_nodes);
+  }
+  if (megabytes > 0) {
+    s.transposition(size_t(megabytes) << 20);
+  }
+  if (interval > 0) {
+    s.decomposition(interval, parallel);
+  }
   s.degeometrize();
-  s.solve();
-  s.print();
-  return 0;
+  SolutionCache cache("hashi", cache_file);
+  vector<string> solution;
+  bool solved = cache.lookup(grid, &solution);
+  if (solved) {
+    s.load_solution(solution);
+  } else if (s.solve()) {
+    solved = true;
+    cache.store(grid, s.solution_grid());
+  }
+  cache.report();
+  if (solved) {
+    s.print();
+  }
+  if (s.aborted()) {
+    return 1;
+  }
+  return s.paused() ? 2 : 0;
 }
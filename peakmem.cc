@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Usage: peakmem command [args...]
+// Runs the command and then prints its peak resident memory. Linux counts
+// the memory of the parent at fork time in the peak of a child, so the
+// command is forked from this small process rather than from a script.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: peakmem command [args...]\n");
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[1], argv + 1);
+    perror(argv[1]);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+    perror("peakmem");
+    return 1;
+  }
+  printf("Peak memory: %ld KB\n", usage.ru_maxrss);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
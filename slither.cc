@@ -3,7 +3,11 @@
 #include <cctype>
 #include <cstdio>
 #include <queue>
+#include <memory>
+#include <cstdlib>
+#include <unistd.h>
 #include "constraint.h"
+#include "cache.h"
 
 using namespace std;
 
@@ -21,6 +25,7 @@ struct Link {
 };
 
 struct Cell {
+  int y, x;
   int size;
   vector<int> links;
 };
@@ -74,6 +79,12 @@ class SingleLineConstraint : public ExternalConstraint {
     }
     return true;
   }
+
+  // A single loop may only be checked on the combined solution.
+  virtual bool project(const State* state,
+      vector<vector<VariableId>>* groups) const {
+    return false;
+  }
 };
 
 class PointConstraint : public TightenConstraint {
@@ -125,9 +136,40 @@ class SlitherLinkSolver {
   vector<Node> nodes;
   vector<Link> links;
   vector<Cell> cells;
+  vector<int> values;
+  bool bulk;
  public:
   SlitherLinkSolver(int width_, int height_, const vector<string>& grid_)
-      : width(width_), height(height_), grid(grid_) {}
+      : width(width_), height(height_), grid(grid_), bulk(false) {}
+
+  // Propagate the cell and vertex sums in bulk sweeps.
+  void bulk_propagation() {
+    bulk = true;
+  }
+
+  void trace(TraceFile* file) {
+    solver.set_trace(file);
+  }
+
+  void checkpoint(const char* filename, int max_nodes) {
+    solver.set_checkpoint(filename, max_nodes);
+  }
+
+  void transposition(size_t bytes) {
+    solver.set_transposition(bytes);
+  }
+
+  void decomposition(int interval, bool parallel) {
+    solver.set_decomposition(interval, parallel);
+  }
+
+  bool paused() const {
+    return solver.paused();
+  }
+
+  bool aborted() const {
+    return solver.aborted();
+  }
 
   int getid(int j, int i) {
     return j * (width + 1) + i;
@@ -172,6 +214,8 @@ class SlitherLinkSolver {
       for (int i = 0; i < width; i++) {
         if (isdigit(grid[j][i])) {
           Cell cell;
+          cell.y = j;
+          cell.x = i;
           cell.size = grid[j][i] - '0';
           cell.links = cellpos[j][i];
           cells.push_back(cell);
@@ -185,37 +229,84 @@ class SlitherLinkSolver {
       link.id = solver.create_variable(0, 1);
     }
     vector<TightenConstraint*> linear;
+    auto sums = bulk ? new BulkLinearConstraint() : nullptr;
+    // Position of each sum of the bulk constraint.
+    vector<pair<int, int>> positions;
     for (const Cell& cell : cells) {
+      if (bulk && sums->add_sum(cell.size, cell.size, vector<VariableId>(
+              cell.links.begin(), cell.links.end()))) {
+        positions.push_back(make_pair(2 * cell.y + 1, 2 * cell.x + 1));
+        continue;
+      }
       auto cons = new LinearConstraint(cell.size, cell.size);
       for (int link : cell.links) {
         cons->add_variable(link);
       }
       linear.push_back(cons);
-      solver.add_constraint(cons);
+      int id = solver.add_constraint(cons);
+      solver.label_constraint(id, 2 * cell.y + 1, 2 * cell.x + 1);
     }
     for (const Node& node : nodes) {
+      if (bulk && sums->add_sum(0, 2, node.links)) {
+        positions.push_back(make_pair(2 * node.y, 2 * node.x));
+        continue;
+      }
       auto cons = new LinearConstraint(0, 2);
       for (int link : node.links) {
         cons->add_variable(link);
       }
       linear.push_back(cons);
-      solver.add_constraint(cons);
+      int id = solver.add_constraint(cons);
+      solver.label_constraint(id, 2 * node.y, 2 * node.x);
+    }
+    if (bulk) {
+      linear.push_back(sums);
+      int id = solver.add_constraint(sums);
+      for (int i = 0; i < int(positions.size()); i++) {
+        solver.label_part(id, i, positions[i].first, positions[i].second);
+      }
     }
     vector<PointConstraint*> external;
     for (const Node& node : nodes) {
       PointConstraint *pc = new PointConstraint(node.links);
       linear.push_back(pc);
-      solver.add_constraint(pc);
+      int id = solver.add_constraint(pc);
+      solver.label_constraint(id, 2 * node.y, 2 * node.x);
     }
     SingleLineConstraint single_line(nodes, links);
     solver.add_external_constraint(&single_line);
     bool result = solver.solve();
+    if (result) {
+      values.resize(links.size());
+      for (const Link& link : links) {
+        values[link.id] = solver.value(link.id);
+      }
+    }
     for (auto cons : external) {
       delete cons;
     }
     return result;
   }
 
+  // The solution in a grid with twice the resolution, where each link
+  // is stored between its two nodes.
+  vector<string> solution_grid() {
+    vector<string> solution(2 * height + 1, string(2 * width + 1, '.'));
+    for (const Link& link : links) {
+      solution[nodes[link.a].y + nodes[link.b].y]
+              [nodes[link.a].x + nodes[link.b].x] = '0' + values[link.id];
+    }
+    return solution;
+  }
+
+  void load_solution(const vector<string>& solution) {
+    values.resize(links.size());
+    for (const Link& link : links) {
+      values[link.id] = solution[nodes[link.a].y + nodes[link.b].y]
+                                [nodes[link.a].x + nodes[link.b].x] - '0';
+    }
+  }
+
   void print() {
     FILE *f = fopen("slither.dot", "wt");
     fprintf(f, "graph {\n");
@@ -234,7 +325,7 @@ class SlitherLinkSolver {
       }
     }
     for (const Link& link : links) {
-      if (solver.value(link.id) > 0) {
+      if (values[link.id] > 0) {
         fprintf(f, "n%d_%d -- n%d_%d;\n", 
                 nodes[link.a].y, nodes[link.a].x,
                 nodes[link.b].y, nodes[link.b].x);
@@ -246,17 +337,93 @@ class SlitherLinkSolver {
   }
 };
 
-int main() {
+// Usage: slither [-t trace] [-c checkpoint [-n nodes]] [-s cache]
+//     [-m megabytes] [-b] [-d interval [-p]] < puzzle
+// Tracing with -t is only available in the -trace builds.
+// With a checkpoint the search pauses after the given number of nodes,
+// saves the checkpoint and exits with 2, or with 1 if it cannot be saved;
+// run again to resume. Solutions are kept in the cache file and reused for
+// rotations and reflections.
+// With -m, failed states are remembered in a table of that size, which
+// only helps with -d and without -p. With -b, cell and vertex sums are
+// propagated in bulk. With -d, independent parts of the board are solved
+// apart every interval levels, in parallel with -p.
+int main(int argc, char **argv) {
+  const char *trace_file = nullptr, *checkpoint_file = nullptr;
+  const char *cache_file = nullptr;
+  int max_nodes = -1, megabytes = 0, interval = 0;
+  bool bulk = false, parallel = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:n:s:m:bd:p")) != -1) {
+    if (opt == 't') {
+#ifdef CONSTRAINT_TRACE
+      trace_file = optarg;
+#else
+      cerr << "-t needs a build with -DCONSTRAINT_TRACE, see slither-trace\n";
+      return 1;
+#endif
+    } else if (opt == 'c') {
+      checkpoint_file = optarg;
+    } else if (opt == 'n') {
+      max_nodes = atoi(optarg);
+      if (max_nodes <= 0) {
+        cerr << "-n needs a positive number of nodes\n";
+        return 1;
+      }
+    } else if (opt == 's') {
+      cache_file = optarg;
+    } else if (opt == 'm') {
+      megabytes = atoi(optarg);
+    } else if (opt == 'b') {
+      bulk = true;
+    } else if (opt == 'd') {
+      interval = atoi(optarg);
+    } else if (opt == 'p') {
+      parallel = true;
+    } else {
+      return 1;
+    }
+  }
   int width, height;
   cin >> width >> height;
   vector<string> grid(height);
   for (int i = 0; i < height; i++) {
     cin >> grid[i];
   }
+  unique_ptr<TraceFile> trace(
+      trace_file != nullptr ? new TraceFile(trace_file) : nullptr);
   SlitherLinkSolver s(width, height, grid);  
+  if (trace) {
+    s.trace(trace.get());
+  }
+  if (checkpoint_file != nullptr) {
+    s.checkpoint(checkpoint_file, max_nodes);
+  }
+  if (megabytes > 0) {
+    s.transposition(size_t(megabytes) << 20);
+  }
+  if (interval > 0) {
+    s.decomposition(interval, parallel);
+  }
+  if (bulk) {
+    s.bulk_propagation();
+  }
   s.degeometrize();
-  if (s.solve()) {
+  SolutionCache cache("slither", cache_file);
+  vector<string> solution;
+  bool solved = cache.lookup(grid, &solution);
+  if (solved) {
+    s.load_solution(solution);
+  } else if (s.solve()) {
+    solved = true;
+    cache.store(grid, s.solution_grid());
+  }
+  cache.report();
+  if (solved) {
     s.print();
   }
-  return 0;
+  if (s.aborted()) {
+    return 1;
+  }
+  return s.paused() ? 2 : 0;
 }
@@ -0,0 +1,120 @@
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+// Search tree tracing. Events are only recorded when compiled with
+// -DCONSTRAINT_TRACE, otherwise every TRACE() vanishes.
+#ifdef CONSTRAINT_TRACE
+#define TRACE(tracer, call) do { if (tracer) { (tracer)->call; } } while (0)
+#else
+#define TRACE(tracer, call) do {} while (0)
+#endif
+
+enum TraceKind : uint8_t {
+  kDecision,    // a = variable, b = value
+  kPropagated,  // a = constraints checked
+  kConflict,    // a = failing constraint or part, b = constraints checked
+  kRejected,    // a = failing external constraint
+  kSolution,
+  kSplit,       // a = number of components
+  kLabel        // a = constraint or part, b = y << 16 | x
+};
+
+// Parts of a constraint, like the sums of a bulk constraint, are labelled
+// from here on, above the ids of whole constraints.
+const int kPartLabels = 1 << 24;
+
+// The file is a magic header followed by blocks of events, each block
+// prefixed by the thread number and the event count, in native byte order.
+struct TraceEvent {
+  uint8_t kind;
+  uint8_t depth_high;
+  uint16_t depth_low;
+  int32_t a, b;
+
+  static const int kMaxDepth = (1 << 24) - 1;
+
+  // Deeper levels are all recorded as kMaxDepth.
+  void set_depth(int depth) {
+    depth = std::min(depth, kMaxDepth);
+    depth_high = depth >> 16;
+    depth_low = depth & 0xFFFF;
+  }
+
+  int get_depth() const {
+    return depth_high << 16 | depth_low;
+  }
+};
+
+const char kTraceMagic[4] = {'C', 'T', 'R', 'C'};
+
+class TraceFile {
+  FILE *f;
+  std::mutex lock;
+ public:
+  TraceFile(const char* filename) {
+    f = fopen(filename, "wb");
+    if (f != nullptr) {
+      fwrite(kTraceMagic, 1, sizeof(kTraceMagic), f);
+    }
+  }
+  ~TraceFile() {
+    if (f != nullptr) {
+      fclose(f);
+    }
+  }
+
+  void write_block(int thread, const TraceEvent* events, int count) {
+    if (f == nullptr || count == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t header[2] = {uint32_t(thread), uint32_t(count)};
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(events, sizeof(TraceEvent), count, f);
+  }
+};
+
+// Buffer of events owned by a single thread, flushed to the file
+// whenever it wraps around. The main search is thread 0, and worker i of
+// the pool is thread i + 1.
+class Tracer {
+  TraceFile* file;
+  int thread;
+  int depth;
+  int used;
+  std::vector<TraceEvent> ring;
+ public:
+  Tracer(TraceFile* file_, int thread_ = 0, int capacity = 1 << 16)
+      : file(file_), thread(thread_), depth(0), used(0), ring(capacity) {}
+  ~Tracer() {
+    flush();
+  }
+
+  TraceFile* get_file() const {
+    return file;
+  }
+
+  void decision(int depth_, int var, int value) {
+    depth = depth_;
+    record(kDecision, var, value);
+  }
+
+  void record(TraceKind kind, int a, int b = 0) {
+    TraceEvent& event = ring[used++];
+    event.kind = kind;
+    event.set_depth(depth);
+    event.a = a;
+    event.b = b;
+    if (used == int(ring.size())) {
+      flush();
+    }
+  }
+
+  void flush() {
+    file->write_block(thread, ring.data(), used);
+    used = 0;
+  }
+};
@@ -0,0 +1,167 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include "trace.h"
+
+using namespace std;
+
+struct Position {
+  int y, x;
+};
+
+class TraceReader {
+  vector<TraceEvent> events;
+  map<int, Position> labels;
+  int threads;
+ public:
+  TraceReader() : threads(0) {}
+
+  bool read(const char* filename) {
+    FILE *f = fopen(filename, "rb");
+    if (f == nullptr) {
+      return false;
+    }
+    char magic[4];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+      fclose(f);
+      return false;
+    }
+    uint32_t header[2];
+    while (fread(header, sizeof(header), 1, f) == 1) {
+      threads = max<int>(threads, header[0] + 1);
+      int start = events.size();
+      events.resize(start + header[1]);
+      if (fread(&events[start], sizeof(TraceEvent), header[1], f) !=
+          header[1]) {
+        fclose(f);
+        return false;
+      }
+    }
+    fclose(f);
+    for (const auto& event : events) {
+      if (event.kind == kLabel) {
+        labels[event.a] = Position{event.b >> 16, event.b & 0xFFFF};
+      }
+    }
+    return true;
+  }
+
+  void summary() {
+    const char* names[] = {"decisions", "propagations", "conflicts",
+                           "rejections", "solutions", "splits", "labels"};
+    vector<long long> count(kLabel + 1, 0);
+    vector<long long> nodes, failures;
+    map<int, long long> conflicts;
+    long long checked = 0;
+    for (const auto& event : events) {
+      count[event.kind]++;
+      if (event.kind == kDecision) {
+        int depth = event.get_depth();
+        if (int(nodes.size()) <= depth) {
+          nodes.resize(depth + 1, 0);
+          failures.resize(depth + 1, 0);
+        }
+        nodes[depth]++;
+      } else if (event.kind == kPropagated) {
+        checked += event.a;
+      } else if (event.kind == kConflict || event.kind == kRejected) {
+        if (event.kind == kConflict) {
+          conflicts[event.a]++;
+          checked += event.b;
+        }
+        if (event.get_depth() < int(failures.size())) {
+          failures[event.get_depth()]++;
+        }
+      }
+    }
+    cout << "Events: " << events.size() << "\n";
+    cout << "Threads: " << threads << "\n";
+    for (int i = 0; i <= kLabel; i++) {
+      cout << names[i] << ": " << count[i] << "\n";
+    }
+    cout << "Constraints checked: " << checked << "\n";
+    cout << "\ndepth decisions failures\n";
+    for (int i = 0; i < int(nodes.size()); i++) {
+      cout << i << " " << nodes[i] << " " << failures[i] << "\n";
+    }
+    vector<pair<long long, int>> top;
+    for (const auto& cons : conflicts) {
+      top.push_back(make_pair(cons.second, cons.first));
+    }
+    sort(top.rbegin(), top.rend());
+    cout << "\nconstraint conflicts y x\n";
+    for (int i = 0; i < min(20, int(top.size())); i++) {
+      cout << top[i].second << " " << top[i].first;
+      auto label = labels.find(top[i].second);
+      if (label != labels.end()) {
+        cout << " " << label->second.y << " " << label->second.x;
+      }
+      cout << "\n";
+    }
+  }
+
+  // Writes the conflicts per grid position as a PGM image.
+  void heatmap() {
+    int height = 0, width = 0;
+    for (const auto& label : labels) {
+      height = max(height, label.second.y + 1);
+      width = max(width, label.second.x + 1);
+    }
+    vector<vector<long long>> heat(height, vector<long long>(width, 0));
+    long long hottest = 1;
+    for (const auto& event : events) {
+      if (event.kind == kConflict) {
+        auto label = labels.find(event.a);
+        if (label != labels.end()) {
+          long long& cur = heat[label->second.y][label->second.x];
+          cur++;
+          hottest = max(hottest, cur);
+        }
+      }
+    }
+    printf("P2\n%d %d\n255\n", width, height);
+    for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+        printf("%lld ", heat[j][i] * 255 / hottest);
+      }
+      printf("\n");
+    }
+  }
+
+  void csv() {
+    printf("kind,depth,a,b\n");
+    for (const auto& event : events) {
+      printf("%d,%d,%d,%d\n", event.kind, event.get_depth(), event.a,
+             event.b);
+    }
+  }
+};
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    cerr << "usage: tracetool summary|heatmap|csv trace.bin\n";
+    return 1;
+  }
+  TraceReader reader;
+  if (!reader.read(argv[2])) {
+    cerr << "cannot read " << argv[2] << "\n";
+    return 1;
+  }
+  string command = argv[1];
+  if (command == "summary") {
+    reader.summary();
+  } else if (command == "heatmap") {
+    reader.heatmap();
+  } else if (command == "csv") {
+    reader.csv();
+  } else {
+    cerr << "unknown command " << command << "\n";
+    return 1;
+  }
+  return 0;
+}
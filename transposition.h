@@ -0,0 +1,109 @@
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+// Hash of a state. The check is computed independently of the key, so
+// two states with the same key are still told apart, as a collision.
+struct StateHash {
+  uint64_t key;
+  uint32_t check;
+
+  StateHash& operator^=(const StateHash& other) {
+    key ^= other.key;
+    check ^= other.check;
+    return *this;
+  }
+};
+
+// Hashes of states already proven to have no solution. The table is split
+// in buckets of four entries; a new entry evicts the one in its bucket
+// whose proof took the fewest nodes.
+class TranspositionTable {
+  struct Entry {
+    uint64_t key;
+    uint32_t check;
+    uint32_t work;
+  };
+  static const int kWays = 4;
+  std::vector<Entry> entries;
+  uint64_t mask;
+  long long lookups, hits, collisions, full_buckets, stores, evictions;
+
+  // Zero is reserved for empty entries.
+  static uint64_t nonzero(uint64_t key) {
+    return key != 0 ? key : 1;
+  }
+
+  Entry* bucket(uint64_t key) {
+    return &entries[(key & mask) * kWays];
+  }
+ public:
+  // Uses at most the given number of bytes, rounded down to a power of
+  // two number of buckets.
+  TranspositionTable(size_t bytes)
+      : lookups(0), hits(0), collisions(0), full_buckets(0), stores(0),
+        evictions(0) {
+    size_t buckets = 1;
+    while (buckets * 2 * kWays * sizeof(Entry) <= bytes) {
+      buckets *= 2;
+    }
+    entries.resize(buckets * kWays, Entry{0, 0, 0});
+    mask = buckets - 1;
+  }
+
+  // Counts a collision when the key is found with another check, and a
+  // full bucket when a missing state finds no free entry, so storing it
+  // would evict another one.
+  bool failed(const StateHash& hash) {
+    lookups++;
+    uint64_t key = nonzero(hash.key);
+    Entry* b = bucket(key);
+    bool occupied = true;
+    for (int i = 0; i < kWays; i++) {
+      if (b[i].key == key) {
+        if (b[i].check == hash.check) {
+          hits++;
+          return true;
+        }
+        collisions++;
+        return false;
+      }
+      occupied &= b[i].key != 0;
+    }
+    if (occupied) {
+      full_buckets++;
+    }
+    return false;
+  }
+
+  // A colliding entry with the same key is replaced.
+  void store(const StateHash& hash, int work) {
+    stores++;
+    uint64_t key = nonzero(hash.key);
+    Entry* b = bucket(key);
+    Entry* victim = &b[0];
+    for (int i = 0; i < kWays; i++) {
+      if (b[i].key == key || b[i].key == 0) {
+        victim = &b[i];
+        break;
+      }
+      if (b[i].work < victim->work) {
+        victim = &b[i];
+      }
+    }
+    if (victim->key != 0 && victim->key != key) {
+      evictions++;
+    }
+    victim->key = key;
+    victim->check = hash.check;
+    victim->work = work;
+  }
+
+  void report() {
+    std::cout << "Transposition hits: " << hits << "/" << lookups << "\n";
+    std::cout << "Transposition collisions: " << collisions << "\n";
+    std::cout << "Transposition full buckets: " << full_buckets << "\n";
+    std::cout << "Transposition stores: " << stores
+              << ", evictions: " << evictions << "\n";
+  }
+};